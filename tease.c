@@ -24,22 +24,43 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <errno.h> // ENOENT
+#include <errno.h> // ENOENT, EAGAIN
+#include <fcntl.h> // open, fcntl
+#include <inttypes.h> // uint64_t, PRIx64, SCNx64
+#include <limits.h> // INT_MAX
+#include <math.h> // sqrt
+#include <poll.h> // poll
+#include <regex.h> // regcomp, regexec
+#include <signal.h> // sigaction, kill
 #include <spawn.h> // posix_spawnp
 #include <stdio.h>  // fprintf
-#include <stdlib.h> // exit
+#include <stdlib.h> // exit, qsort, bsearch
 #include <stdbool.h> // bool
 #include <stdarg.h> // va_start, va_end
-#include <sys/stat.h> // stat, fstat
-#include <sys/wait.h> // waitpid
-#include <time.h> // nanosleep
-#include <unistd.h> // mkstemp
+#include <string.h> // strcmp, strncmp, strsignal
+#include <sys/ioctl.h> // ioctl, TIOCGWINSZ
+#include <sys/resource.h> // struct rusage
+#include <sys/stat.h> // fstat, fchmod
+#include <sys/wait.h> // waitpid, wait4
+#include <time.h> // nanosleep, clock_gettime
+#include <unistd.h> // mkstemp, tcsetpgrp
 
 
 #define POLL_TIME_IN_MS 30
 #define FAILED_TO_WRITE_TO_STDERR 12
 #define HOW_MANY_BYTES_FROM_THE_END 500
 #define PRINT_BUF_SIZE 8192
+#define MAX_LINE_BYTES 4096
+#define PIN_PENDING_MAX (64 * 1024)
+#define VERSUS_SEPARATOR "--versus"
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_SYNC_EVERY 16
+#define JOURNAL_SYNC_SECS 5
+#define DEFAULT_BASELINE_FILE ".tease-warnings"
+#define DEFAULT_WARNING_PATTERN "(^|[^[:alnum:]_-])warning( [a-z]*[0-9]+)?:"
+#define DEFAULT_ERROR_PATTERN "(^|[^[:alnum:]_-])(error|fatal|failed)( [a-z]*[0-9]+)?:"
+#define ERROR_CONTEXT_LINES 3
+#define FAIL_FAST_GRACE_SECS 5
 
 // Tenets/Self-guidance:
 //
@@ -48,6 +69,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // - Don't worry about multiple paths yet; such as if enough memory, use mem instead of temp file.
 // - Just use a temp file for now.
 
+// The temp file is shared by every run of a tease invocation (--repeat, --jobs),
+// so there's a single mkstemp and unlink however many runs there are. Jobs run
+// one at a time, so it is truncated before each run and holds just that run's
+// output.
+
 // List of things to watch out:
 // 
 // - The file created by tmpfile() call might be left on the fs on abnormal termination - implementation-defined.
@@ -62,29 +88,126 @@ void error(const char* fmt, ...) {
 	va_end(ap);
 }
 
+// Like asprintf, which is not in POSIX. Exits if there is no memory.
+char* format_string(const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	char* str = len < 0 ? NULL : malloc(len + 1);
+	if (str == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	va_start(ap, fmt);
+	vsnprintf(str, len + 1, fmt, ap);
+	va_end(ap);
+	return str;
+}
+
 int min(int n1, int n2) {
 	return n1 < n2 ? n1 : n2;
 }
 
+// Clamps a file size to an int, for comparing with buffer sizes
+int min_off(off_t n) {
+	return n < INT_MAX ? (int)n : INT_MAX;
+}
+
+// Reads the non-blank lines of path. Unless the file holds records written by
+// tease, # comments are skipped; otherwise a last line without the new line is a
+// torn write, and it is skipped.
+// Returns the number of lines, or -1 if the file couldn't be read.
+int read_lines(const char* path, bool records, char*** lines) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+
+	int count = 0, capacity = 64;
+	*lines = malloc(capacity * sizeof(char*));
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	while (*lines != NULL && (len = getline(&line, &line_cap, file)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = 0;
+		} else if (records) {
+			continue; // Torn record
+		}
+		if (len == 0 || (!records && line[0] == '#')) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity *= 2;
+			char** grown = realloc(*lines, capacity * sizeof(char*));
+			if (grown == NULL) {
+				free(*lines);
+				*lines = NULL;
+				break;
+			}
+			*lines = grown;
+		}
+		if (((*lines)[count++] = strdup(line)) == NULL) {
+			count--;
+			break;
+		}
+	}
+	free(line);
+	fclose(file);
+
+	if (*lines == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+void free_lines(char** lines, int count) {
+	for (int i = 0; i < count; i++) {
+		free(lines[i]);
+	}
+	free(lines);
+}
+
 static char tmpfilename_in_cwd[] = "._tease.XXXXXX";
 static char tmpfilename_in_tmp[] = "/tmp/tease.XXXXXX";
+static bool delete_file_in_cwd = true;
 
-int main(int argc, char* argv[], char* envp[]) {
-	// Create a temp file
-	// Capture the output
-	// Write the content to the temp file
-	// Also, grab the last line
-	// Print it
+// The child being waited on, so that the signal handler can pass the signal on
+static volatile pid_t running_child = 0;
+// Whether it has its own process group, which gets the signals then
+static volatile sig_atomic_t running_in_group = 0;
 
-	// Check inputs
-	if (argc <= 1) {
-		error("usage: tease COMMAND...\n");
-		exit(EXIT_FAILURE);
+static volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int sig, siginfo_t* info, void* context) {
+	(void)context;
+	interrupted = sig;
+	// Ctrl-C reaches the child anyway, unless it is in its own group, but a kill(1)
+	// on tease doesn't. Passing on the terminal's signal would be a second one for
+	// the child, which some tools take as "abort now, skip the cleanup".
+	bool from_process = info != NULL && (info->si_code == SI_USER || info->si_code == SI_QUEUE) && info->si_pid > 0;
+	if (running_child > 0 && (running_in_group || from_process)) {
+		kill(running_in_group ? -running_child : running_child, sig);
 	}
+}
 
-	int exit_status = EXIT_SUCCESS;
+// Stay alive on interrupts, so that tease can clean up after the child is gone
+void catch_interrupts(void) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = on_interrupt;
+	action.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+}
+
+int create_temp_file(void) {
 	int tmpfd;
-	bool delete_file_in_cwd = true;
 	if ((tmpfd = mkstemp(tmpfilename_in_cwd)) < 0) {
 		delete_file_in_cwd = false;
 		perror("Trying to create a temp file in the current directory has failed. Trying /tmp instead");
@@ -93,196 +216,1904 @@ int main(int argc, char* argv[], char* envp[]) {
 			exit(EXIT_FAILURE);
 		}
 	}
+	return tmpfd;
+}
 
-	/*
-		How to read child's output and send to a file:
-			- Create a pipe
-			- Tie the pipe's input to the stdout of the child
-			- And read from the pie's output from the parent
-			- Then, we can grab the last line for print
-			- While writing the whole thing to the tempfile we created above.
+void remove_temp_file(int tmpfd) {
+	if (delete_file_in_cwd) {
+		if (unlink(tmpfilename_in_cwd) < 0) {
+			perror("Deleting the temp file in current working dir has failed");
+			error("Please delete: %s\n", tmpfilename_in_cwd);
+		}
+	} else {
+		if (unlink(tmpfilename_in_tmp) < 0) {
+			perror("Deleting the temp file has failed");
+			error("You can delete this file manually: %s\n", tmpfilename_in_tmp);
+		}
+	}
 
-		Alternatively,
-			- Tie the pipe's output to the file directly
-			- Watch the file via inotify (or poll/read every 200ms).
-			- And read the changes
+	if (close(tmpfd) < 0) {
+		perror("Cloudn't close the temp file, but that should be fine");
+	}
+}
 
-		Decided to go with the alternative path and polling (inotify etc are platform
-		specific). And, I think piping from the child straight to the temp file would be
-		faster, though I didn't measure. Just assuming that in the first option, tease
-		process might become a bottleneck. With the approach I chose, we are not in between
-		that process, we just read from the output file at certain intervals.
-	*/
+// How a single run of the command is presented
+struct run_options {
+	// Don't tease the output, block on the child instead
+	bool quiet;
+	// Keep the last teased line on success, instead of clearing it
+	bool keep_last_line;
+	// Printed in front of the teased line
+	const char* prefix;
+	// Where to collect the warnings, if the ratchet is on
+	struct warning_set* warnings;
+	// Pin the teased line to the bottom row and show stderr above it
+	bool pin;
+	// Where to look for errors, if they are to be shown early
+	struct error_watch* errors;
+	// Called at every poll while the command runs, if set
+	void (*on_poll)(void* ctx);
+	void* poll_ctx;
+};
 
-	posix_spawn_file_actions_t file_actions;
-	if (posix_spawn_file_actions_init(&file_actions) < 0) {
-		perror("Couldn't init file actions");
-		goto cleanup_temp_file;
+// What a single run of the command cost. Filled in by run_command.
+struct run_result {
+	int exit_status;
+	double wall_secs;
+	double cpu_secs; // user + sys
+	double max_rss_kb;
+};
+
+double timespec_diff_secs(const struct timespec* start, const struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double timeval_secs(const struct timeval* tv) {
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// How far the child has written, see the temp file notes at the top
+off_t capture_end(int tmpfd) {
+	struct stat file_status;
+	if (fstat(tmpfd, &file_status) < 0) {
+		perror("Couldn't stat the temp file");
+		return -1;
 	}
+	return file_status.st_size;
+}
 
-	// addup2 closes the dest file descr (stdout) if it is open before duplication
-	if (posix_spawn_file_actions_adddup2(&file_actions, tmpfd, STDOUT_FILENO) < 0) {
-	  perror("Couldn't connect stdout to the temp file"); goto cleanup;
+// Reads the last line the child has written so far into last_line, which must
+// hold HOW_MANY_BYTES_FROM_THE_END + 1 bytes.
+// Returns where the line starts, or NULL if nothing new has been written.
+const char* read_last_line(int tmpfd, off_t* last_size, char* last_line) {
+	off_t end = capture_end(tmpfd);
+	if (end <= *last_size) {
+		return NULL;
 	}
 
-  // What to do with the stderr
-  //
-  //   - Option 1: connect to the same output as stdout (will lose what is
-  //   stdout and what is stderr)
-  //   - Option 2: connect to another file (will lose the order)
-  //   - Option 3: don't touch it, let it go to the terminal (it will be
-  //   printed before stdout if the process exit with non-zero, but better
-  //   to let the user know about the errors and shell redirections would
-  //   work).
-  //	 - Option 4: connect to the same file as stdout, but with a
-  //   different color (not sure if possible)
-  //
-  // Let's go with the option 1. Not much code, and can be converted to 4.
-  // In the future, I might change this into Option 3 since the error messages
-  // are important. For programs that spams stderr, there can be an option
-  // or use shell redirection feature like &2>1.
-  //
-  if (posix_spawn_file_actions_adddup2(&file_actions, tmpfd, STDERR_FILENO) < 0) {
-	  perror("Couldn't connect stderr to the temp file"); goto cleanup;
+	// There's stuff to read. pread doesn't move the shared file offset.
+	int how_many_bytes = min(HOW_MANY_BYTES_FROM_THE_END, min_off(end));
+	int nread;
+	if ((nread = pread(tmpfd, last_line, how_many_bytes, end - how_many_bytes)) <= 0) {
+		if (nread < 0) {
+			perror("Couldn't read the temp file");
+		}
+		return NULL;
 	}
 
-	pid_t child_pid;
-	int spawn_res = posix_spawnp(
-		/* pid */ &child_pid,
-		/* file */ argv[1],
-		/* file actions */ &file_actions,
-		/* attrp */ NULL,
-		/* argv */ argv + 1,
-		envp
-	);
+	// Make it a C string
+	last_line[nread] = 0;
 
-	if (spawn_res == ENOENT) {
-		error("Unknown command: %s\n", argv[1]);
-		exit_status = EXIT_FAILURE;
-		goto cleanup;
+	// If the child is doing buffered IO, there's a high chance that the last char is
+	// new line. Let's just ignore that
+	if (last_line[nread - 1] == '\n') {
+		last_line[nread - 1] = 0;
+	}
+	// Look for the \n character - this should work for windows too, since we care the rest, whether there's \r or not, we don't care
+	int pos_of_nl = nread - 1;
+	while (pos_of_nl > 0) {
+		if (last_line[--pos_of_nl] == '\n') {
+			break;
+		}
 	}
 
-	if (spawn_res != 0) {
-		perror("Couldn't start the process");
-		exit_status = EXIT_FAILURE;
-		goto cleanup;
+	*last_size = end;
+	return last_line + pos_of_nl + /* add 1 if new line */ (pos_of_nl != 0);
+}
+
+// Prints the full content of the temp file, used when the child fails.
+int dump_output(int tmpfd) {
+	printf("\x1b[2K\r");
+	fflush(stdout);
+
+	char buf[PRINT_BUF_SIZE];
+	off_t offset = 0;
+	int read_result;
+	// One less from the buffer size for C style string
+	while ((read_result = pread(tmpfd, buf, PRINT_BUF_SIZE - 1, offset)) > 0) {
+		buf[read_result] = 0;
+		printf("%s", buf);
+		offset += read_result;
 	}
+	fflush(stdout);
+	if (read_result < 0) {
+		perror("Couldn't read the temp file");
+		return -1;
+	}
+	return 0;
+}
 
-	// start polling the file
-	struct stat file_status;
-	struct timespec time_spec;
-	time_spec.tv_nsec = POLL_TIME_IN_MS * 1000 * 1000;
-	time_spec.tv_sec = 0;
-	int last_size = 0;
-	char last_line[HOW_MANY_BYTES_FROM_THE_END + 1];
+// Warning ratchet (--ratchet)
+//
+// The lines matching the warning pattern are collected while the command runs.
+// After a successful run, they are compared with the ones recorded for the same
+// command in the baseline file, and the new ones are printed. Then the baseline
+// is replaced with what this run has, so a fixed warning can't come back
+// unnoticed either. With --ratchet-fail, a run with new warnings fails and the
+// baseline is left as it is.
+//
+// Warnings are compared by a hash of the line with the numbers masked, so that a
+// warning isn't new just because its line number has changed. The baseline file
+// has one record per warning:
+//
+//   <command hash> <signature> <normalized line>\n
+//
+// and one with a zero signature and the command itself, so that a command
+// recorded without any warnings is known.
 
-	// This is going to be useful to print last new line at the end.
-	bool printed_something = false;
-	while (true) {
-		// Let's wait a bit before we do anything
-		nanosleep(&time_spec, NULL);
+struct warning {
+	uint64_t signature;
+	char* line; // as the command printed it
+};
+
+// Each warning is kept once, however many times it is printed. slots is an
+// open addressing table on the signature, with twice as many slots as capacity,
+// holding the index of a warning plus 1, or 0 if the slot is free.
+struct warning_set {
+	regex_t pattern;
+	struct warning* warnings;
+	int count;
+	int capacity;
+	int* slots;
+};
+
+struct ratchet {
+	const char* path;
+	bool fail_on_new;
+	struct warning_set warnings;
+};
+
+// 64 bit FNV-1a
+uint64_t hash_string(const char* str) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *str != 0; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
 
-		if (fstat(tmpfd, &file_status) < 0) {
-			perror("Couldn't stat the temp file");
+// Masks every run of digits with a single #, e.g. line and column numbers.
+// dest must be at least as big as src.
+void normalize_warning(const char* src, char* dest) {
+	while (*src != 0) {
+		if (*src >= '0' && *src <= '9') {
+			*dest++ = '#';
+			while (*src >= '0' && *src <= '9') {
+				src++;
+			}
 		} else {
-			if (file_status.st_size > last_size) {
-				// There's stuff to read
-				int how_many_bytes = min(HOW_MANY_BYTES_FROM_THE_END, file_status.st_size);
-				if (lseek(tmpfd, -1 * how_many_bytes, SEEK_END) < 0) {
-					perror("Couldn't seek in the temp file");
-					continue;
-				}
+			*dest++ = *src++;
+		}
+	}
+	*dest = 0;
+}
 
-				int nread;
-				if ((nread = read(tmpfd, last_line, HOW_MANY_BYTES_FROM_THE_END)) < 0) {
-					perror("Couldn't read the temp file");
-					continue;
-				}
+void warning_set_clear(struct warning_set* set) {
+	for (int i = 0; i < set->count; i++) {
+		free(set->warnings[i].line);
+	}
+	set->count = 0;
+	if (set->slots != NULL) {
+		memset(set->slots, 0, set->capacity * 2 * sizeof(int));
+	}
+}
 
-				// Make it a C string
-				last_line[nread] = 0;
+// The slot of the warning with the signature, or the free one to put it in
+int* warning_set_slot(struct warning_set* set, uint64_t signature) {
+	int mask = set->capacity * 2 - 1;
+	int i = (int)(signature & mask);
+	while (set->slots[i] != 0 && set->warnings[set->slots[i] - 1].signature != signature) {
+		i = (i + 1) & mask;
+	}
+	return &set->slots[i];
+}
 
-				// If the child is doing buffered IO, there's a high chance that the last char is
-				// new line. Let's just ignore that
-				if (last_line[nread - 1] == '\n') {
-					last_line[nread - 1] = 0;
-				}
-				// Look for the \n character - this should work for windows too, since we care the rest, whether there's \r or not, we don't care
-				int pos_of_nl = nread - 1;
-				while (pos_of_nl > 0) {
-					if (last_line[--pos_of_nl] == '\n') {
-						break;
-					}
-				}
+void warning_set_add(struct warning_set* set, const char* line) {
+	char normalized[MAX_LINE_BYTES + 1];
+	normalize_warning(line, normalized);
+	uint64_t signature = hash_string(normalized);
+
+	if (set->slots != NULL && *warning_set_slot(set, signature) != 0) {
+		return;
+	}
+	if (set->count == set->capacity) {
+		set->capacity = set->capacity == 0 ? 64 : set->capacity * 2;
+		set->warnings = realloc(set->warnings, set->capacity * sizeof(struct warning));
+		free(set->slots);
+		set->slots = calloc(set->capacity * 2, sizeof(int));
+		if (set->warnings == NULL || set->slots == NULL) {
+			perror("Couldn't allocate memory");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < set->count; i++) {
+			*warning_set_slot(set, set->warnings[i].signature) = i + 1;
+		}
+	}
+	set->warnings[set->count].signature = signature;
+	if ((set->warnings[set->count].line = strdup(line)) == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	set->count++;
+	*warning_set_slot(set, signature) = set->count;
+}
+
+int compare_signatures(const void* a, const void* b) {
+	uint64_t s1 = *(const uint64_t*)a, s2 = *(const uint64_t*)b;
+	return (s1 > s2) - (s1 < s2);
+}
+
+// Rewrites the baseline with the records of the other commands, plus the given
+// warnings for this one. Goes through a temp file and rename, so that the
+// baseline is never half written. The temp file is unique to this run, since
+// other teases may be updating the same baseline.
+int save_baseline(const char* path, char** lines, int nlines, const char* command, uint64_t command_hash, struct warning_set* set) {
+	char* tmp_path = format_string("%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	FILE* file = NULL;
+	// mkstemp creates it only readable by the owner
+	if (fd < 0 || fchmod(fd, 0644) < 0 || (file = fdopen(fd, "w")) == NULL) {
+		perror("Couldn't write the warning baseline");
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		return -1;
+	}
+
+	for (int i = 0; i < nlines; i++) {
+		uint64_t hash;
+		if (sscanf(lines[i], "%" SCNx64, &hash) == 1 && hash != command_hash) {
+			fprintf(file, "%s\n", lines[i]);
+		}
+	}
+	fprintf(file, "%016" PRIx64 " %016" PRIx64 " %s\n", command_hash, (uint64_t)0, command);
+	char normalized[MAX_LINE_BYTES + 1];
+	for (int i = 0; i < set->count; i++) {
+		normalize_warning(set->warnings[i].line, normalized);
+		fprintf(file, "%016" PRIx64 " %016" PRIx64 " %s\n", command_hash, set->warnings[i].signature, normalized);
+	}
+
+	int ret = 0;
+	if (fclose(file) != 0 || rename(tmp_path, path) < 0) {
+		perror("Couldn't write the warning baseline");
+		unlink(tmp_path);
+		ret = -1;
+	}
+	free(tmp_path);
+	return ret;
+}
+
+// Serializes the updates of the baseline by other teases, e.g. parallel CI
+// shards, so that none of them is lost. The lock is on a file of its own, since
+// the baseline is replaced by rename. Returns the fd to close for unlocking, or
+// -1 if it couldn't be locked, then it goes on without.
+int lock_baseline(const char* path) {
+	char* lock_path = format_string("%s.lock", path);
+	int fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+	free(lock_path);
+
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+	int res;
+	while (fd >= 0 && (res = fcntl(fd, F_SETLKW, &lock)) < 0 && errno == EINTR) {
+	}
+	if (fd < 0 || res < 0) {
+		perror("Couldn't lock the warning baseline");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
 
-				printf("\x1B[2K\r%s", last_line + pos_of_nl + /* add 1 if new line */ (pos_of_nl != 0));
-				fflush(stdout);
-				printed_something = true;
+// Compares the warnings of a successful run of command with its baseline,
+// prints the new ones and updates the baseline.
+// Returns true if the run should fail because of the new warnings.
+bool ratchet_check(struct ratchet* ratchet, const char* command) {
+	struct warning_set* set = &ratchet->warnings;
 
-				last_size = file_status.st_size;
+	int lock_fd = lock_baseline(ratchet->path);
+	char** lines;
+	int nlines = read_lines(ratchet->path, true, &lines);
+	if (nlines < 0) {
+		if (errno != ENOENT) {
+			perror("Couldn't read the warning baseline");
+			if (lock_fd >= 0) {
+				close(lock_fd);
 			}
+			return false;
 		}
+		nlines = 0;
+		lines = NULL;
+	}
 
-		int stat_loc;
-		// wait_res will be greater than zero (equals to child_pid) if the child is exited
-		// Hence we can break the loop
-		int wait_res = waitpid(child_pid, &stat_loc, WNOHANG);
-		if (wait_res < 0) {
-			perror("Failed to wait the child");
-			goto cleanup;
-		} else if (wait_res > 0) {
-			// Reflect the exit status of the child
-			exit_status = WEXITSTATUS(stat_loc);
-			if (WIFEXITED(stat_loc) && exit_status == 0) {
-				break; // SUCCESS
-			} else {
-				// Child failed, print the full content of the temp file
-				lseek(tmpfd, 0, SEEK_SET);
-				printf("\x1b[2K\r");
-				fflush(stdout);
-
-				char buf[8192];
-				int read_result;
-				// One less from the buffer size for C style string
-				while ((read_result = read(tmpfd, buf, PRINT_BUF_SIZE - 1)) > 0) {
-					buf[read_result] = 0;
-					printf("%s", buf);
-				}
-				if (read_result < 0) {
-					perror("Couldn't read the temp file");
-					goto cleanup;
-				}
+	uint64_t command_hash = hash_string(command);
+	uint64_t* baseline = calloc(nlines + 1, sizeof(uint64_t));
+	if (baseline == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	int nbaseline = 0;
+	bool recorded_before = false;
+	for (int i = 0; i < nlines; i++) {
+		uint64_t hash, signature;
+		if (sscanf(lines[i], "%" SCNx64 " %" SCNx64, &hash, &signature) == 2 && hash == command_hash) {
+			recorded_before = true;
+			if (signature != 0) {
+				baseline[nbaseline++] = signature;
+			}
+		}
+	}
+	qsort(baseline, nbaseline, sizeof(uint64_t), compare_signatures);
+
+	int new_warnings = 0;
+	for (int i = 0; i < set->count && recorded_before; i++) {
+		if (bsearch(&set->warnings[i].signature, baseline, nbaseline, sizeof(uint64_t), compare_signatures) == NULL) {
+			new_warnings++;
+		}
+	}
 
-				goto cleanup; // Finish
+	if (new_warnings > 0) {
+		printf("%d new warning%s since the baseline (%d in total, %d in the baseline):\n",
+			new_warnings, new_warnings == 1 ? "" : "s", set->count, nbaseline);
+		for (int i = 0; i < set->count; i++) {
+			if (bsearch(&set->warnings[i].signature, baseline, nbaseline, sizeof(uint64_t), compare_signatures) == NULL) {
+				printf("%s\n", set->warnings[i].line);
 			}
 		}
+		fflush(stdout);
 	}
 
-	// Write a newline at the end
-	if (printed_something) {
-		putchar('\n');
+	bool fail = ratchet->fail_on_new && new_warnings > 0;
+	if (!fail) {
+		save_baseline(ratchet->path, lines, nlines, command, command_hash, set);
+	}
+	if (lock_fd >= 0) {
+		close(lock_fd);
 	}
 
-cleanup:
-	if (posix_spawn_file_actions_destroy(&file_actions) < 0) {
-		perror("Couldn't destroy the file actions object");
+	free(baseline);
+	if (lines != NULL) {
+		free_lines(lines, nlines);
 	}
+	return fail;
+}
 
-cleanup_temp_file:
-	if (delete_file_in_cwd) {
-		if (unlink(tmpfilename_in_cwd) < 0) {
-			perror("Deleting the temp file in current working dir has failed");
-			error("Please delete: %s\n", tmpfilename_in_cwd);
+// Splits what a run writes into lines as it comes, for the streaming passes over
+// the output. Lines longer than MAX_LINE_BYTES are cut.
+struct line_scanner {
+	off_t scanned;
+	char line[MAX_LINE_BYTES + 1];
+	int len;
+};
+
+typedef void (*line_handler)(const char* line, void* ctx);
+
+// Feeds the complete lines written since the last call to handle. The last line
+// is complete only when the child has exited, hence at_exit.
+void scan_lines(int tmpfd, off_t end, struct line_scanner* scanner, bool at_exit, line_handler handle, void* ctx) {
+	char buf[PRINT_BUF_SIZE];
+	int nread;
+	while (scanner->scanned < end &&
+	       (nread = pread(tmpfd, buf, min(PRINT_BUF_SIZE, min_off(end - scanner->scanned)), scanner->scanned)) > 0) {
+		for (int i = 0; i < nread; i++) {
+			if (buf[i] != '\n') {
+				if (scanner->len < MAX_LINE_BYTES) {
+					scanner->line[scanner->len++] = buf[i];
+				}
+				continue;
+			}
+			if (scanner->len > 0 && scanner->line[scanner->len - 1] == '\r') {
+				scanner->len--;
+			}
+			scanner->line[scanner->len] = 0;
+			handle(scanner->line, ctx);
+			scanner->len = 0;
 		}
-	} else {
-		if (unlink(tmpfilename_in_tmp) < 0) {
-			perror("Deleting the temp file has failed");
-			error("You can delete this file manually: %s\n", tmpfilename_in_tmp);
+		scanner->scanned += nread;
+	}
+
+	if (at_exit && scanner->len > 0) {
+		scanner->line[scanner->len] = 0;
+		handle(scanner->line, ctx);
+		scanner->len = 0;
+	}
+}
+
+// Pinned status line (--pin)
+//
+// The bottom row of the terminal is kept for the teased line by setting the
+// scroll region (DECSTBM) to the rows above it, and the child's stderr is shown
+// live in that region, i.e. Option 3 in run_command. stdout and stderr both go
+// through pipes, and tease copies them to the temp file in the order it reads
+// them, so that the full output on failure has both. The order is only as good
+// as the reads though: if the command writes to both faster than tease reads
+// them, what it has written in between is grouped by stream in the temp file.
+// The status line is the last line of stdout alone. stderr is put on the
+// screen up to the last \n or \r, so that progress output redrawing a line
+// with \r shows up too. A partial line is held back
+// until it is as wide as the terminal. Whatever comes in during a
+// POLL_TIME_IN_MS frame is drawn with a single write, together with the status
+// line if it has changed, so a chatty stderr doesn't make the screen flicker.
+// If more than PIN_PENDING_MAX bytes come in before the frame ends, they are
+// drawn right away instead of piling up.
+
+static volatile sig_atomic_t resized = 0;
+
+void on_resize(int sig) {
+	(void)sig;
+	resized = 1;
+}
+
+struct buffer {
+	char* data;
+	size_t len;
+	size_t cap;
+};
+
+void buffer_append(struct buffer* buf, const char* data, size_t len) {
+	if (buf->len + len > buf->cap) {
+		size_t cap = buf->cap == 0 ? PRINT_BUF_SIZE : buf->cap;
+		while (cap < buf->len + len) {
+			cap *= 2;
+		}
+		if ((buf->data = realloc(buf->data, cap)) == NULL) {
+			perror("Couldn't allocate memory");
+			exit(EXIT_FAILURE);
 		}
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+void buffer_append_str(struct buffer* buf, const char* str) {
+	buffer_append(buf, str, strlen(str));
+}
+
+struct pinned_screen {
+	int rows;
+	int cols;
+	// stderr that isn't on the screen yet
+	struct buffer pending;
+	// What goes to the terminal in the next write
+	struct buffer frame;
+	char status[HOW_MANY_BYTES_FROM_THE_END + 1];
+	int status_len;
+	bool status_changed;
+	// The next byte of stdout starts a new status line
+	bool status_ended;
+	// The cursor is not at the beginning of a line
+	bool mid_line;
+};
+
+bool update_screen_size(struct pinned_screen* screen) {
+	struct winsize size;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_row < 2 || size.ws_col < 1) {
+		return false;
 	}
+	screen->rows = size.ws_row;
+	screen->cols = size.ws_col;
+	return true;
+}
 
-	if (close(tmpfd) < 0) {
-		perror("Cloudn't close the temp file, but that should be fine");
+// Limits the scrolling to the rows above the status line. Setting the region
+// moves the cursor to the top, hence the save/restore.
+void set_scroll_region(struct pinned_screen* screen) {
+	char region[32];
+	snprintf(region, sizeof(region), "\x1B" "7\x1B[1;%dr\x1B" "8", screen->rows - 1);
+	buffer_append_str(&screen->frame, region);
+}
+
+int flush_frame(struct pinned_screen* screen) {
+	size_t written = 0;
+	while (written < screen->frame.len) {
+		ssize_t n = write(STDOUT_FILENO, screen->frame.data + written, screen->frame.len - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			perror("Couldn't write to the terminal");
+			screen->frame.len = 0;
+			return -1;
+		}
+		written += n;
+	}
+	screen->frame.len = 0;
+	return 0;
+}
+
+// Returns false if stdout is not a terminal that the status line can be pinned to
+bool pin_start(struct pinned_screen* screen) {
+	memset(screen, 0, sizeof(*screen));
+	if (!update_screen_size(screen)) {
+		return false;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_resize;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGWINCH, &action, NULL);
+
+	// Make room for the status line if the cursor is on the bottom row, and clear
+	// the row the cursor is on, the job prefix may already be there
+	fflush(stdout);
+	buffer_append_str(&screen->frame, "\n\x1B[1A\x1B[2K");
+	set_scroll_region(screen);
+	flush_frame(screen);
+	return true;
+}
+
+// Moves what can be shown from pending to the frame: up to the last \n or \r,
+// or all of it with everything set
+void take_pending(struct pinned_screen* screen, bool everything) {
+	size_t cut = screen->pending.len;
+	while (cut > 0 && screen->pending.data[cut - 1] != '\n' && screen->pending.data[cut - 1] != '\r') {
+		cut--;
+	}
+	if (everything || screen->pending.len - cut >= (size_t)screen->cols || screen->pending.len >= PIN_PENDING_MAX) {
+		cut = screen->pending.len;
+	}
+	if (cut == 0) {
+		return;
+	}
+
+	buffer_append(&screen->frame, screen->pending.data, cut);
+	screen->mid_line = screen->pending.data[cut - 1] != '\n';
+	memmove(screen->pending.data, screen->pending.data + cut, screen->pending.len - cut);
+	screen->pending.len -= cut;
+}
+
+// Keeps the last line of stdout, or what is after its last \r, as the status line.
+// What doesn't fit is cut, the screen is narrower anyway.
+void pin_status_append(struct pinned_screen* screen, const char* data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] == '\n' || data[i] == '\r') {
+			screen->status_ended = true;
+			continue;
+		}
+		if (screen->status_ended) {
+			screen->status_len = 0;
+			screen->status_ended = false;
+		}
+		if (screen->status_len < HOW_MANY_BYTES_FROM_THE_END) {
+			screen->status[screen->status_len++] = data[i];
+		}
+	}
+	screen->status[screen->status_len] = 0;
+	screen->status_changed = true;
+}
+
+// Copies a chunk of what the child has written to stdout or stderr to the temp
+// file, and puts stderr in the queue for the screen and stdout in the status
+// line. Returns 0 once the pipe is closed, -1 if there was nothing to read.
+ssize_t relay_output(int pipefd, bool is_stderr, int tmpfd, struct pinned_screen* screen) {
+	char buf[PRINT_BUF_SIZE];
+	ssize_t nread = read(pipefd, buf, sizeof(buf));
+	if (nread < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? -1 : 0;
+	}
+	if (nread == 0) {
+		return 0;
+	}
+	if (write(tmpfd, buf, nread) != nread) {
+		perror("Couldn't write the output to the temp file");
+	}
+
+	if (!is_stderr) {
+		pin_status_append(screen, buf, nread);
+	} else {
+		buffer_append(&screen->pending, buf, nread);
+		if (screen->pending.len >= PIN_PENDING_MAX) {
+			take_pending(screen, false);
+			flush_frame(screen);
+		}
+	}
+	return nread;
+}
+
+// Reads a chunk from each of the pipes that are ready within timeout_ms, stdout
+// first. relayed is stdout and stderr, a closed pipe's fd is set to -1 so that
+// poll skips it. Returns true if anything was read.
+bool relay_ready(struct pollfd relayed[2], int timeout_ms, int tmpfd, struct pinned_screen* screen) {
+	if (poll(relayed, 2, timeout_ms) <= 0) {
+		return false;
+	}
+	bool read_something = false;
+	for (int i = 0; i < 2; i++) {
+		if (relayed[i].fd < 0 || relayed[i].revents == 0) {
+			continue;
+		}
+		ssize_t nread = relay_output(relayed[i].fd, i == 1, tmpfd, screen);
+		if (nread == 0) {
+			relayed[i].fd = -1;
+		}
+		read_something = read_something || nread > 0;
+	}
+	return read_something;
+}
+
+// Waits for the next frame, relaying the output as it comes so the child
+// doesn't block on a full pipe
+void pin_wait_frame(struct pollfd relayed[2], int tmpfd, struct pinned_screen* screen) {
+	struct timespec now, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += POLL_TIME_IN_MS * 1000 * 1000;
+	if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000 * 1000 * 1000;
+	}
+
+	while (true) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int timeout_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / (1000 * 1000);
+		if (timeout_ms <= 0) {
+			return;
+		}
+		// Just sleeps once both pipes are closed, or when there are none
+		relay_ready(relayed, timeout_ms, tmpfd, screen);
+	}
+}
+
+// Cuts str to fit in len bytes without splitting a UTF-8 sequence
+int fit_utf8(const char* str, int len) {
+	int n = strlen(str);
+	if (n <= len) {
+		return n;
+	}
+	while (len > 0 && (str[len] & 0xC0) == 0x80) {
+		len--;
+	}
+	return len;
+}
+
+// Draws the pending stderr above the status line, and the status line, with a
+// single write
+void pin_render(struct pinned_screen* screen, const char* prefix) {
+	if (resized) {
+		resized = 0;
+		if (update_screen_size(screen)) {
+			set_scroll_region(screen);
+			screen->status_changed = true;
+		}
+	}
+
+	take_pending(screen, false);
+
+	if (screen->status_changed) {
+		char row[32];
+		snprintf(row, sizeof(row), "\x1B" "7\x1B[%d;1H\x1B[2K", screen->rows);
+		buffer_append_str(&screen->frame, row);
+		int room = screen->cols - 1;
+		int prefix_len = fit_utf8(prefix, room);
+		buffer_append(&screen->frame, prefix, prefix_len);
+		// Only what is left visible after the \r redraws, if any
+		int status_len = strlen(screen->status);
+		while (status_len > 0 && screen->status[status_len - 1] == '\r') {
+			screen->status[--status_len] = 0;
+		}
+		const char* shown = strrchr(screen->status, '\r');
+		shown = shown != NULL ? shown + 1 : screen->status;
+		buffer_append(&screen->frame, shown, fit_utf8(shown, room - prefix_len));
+		buffer_append_str(&screen->frame, "\x1B" "8");
+		screen->status_changed = false;
+	}
+
+	if (screen->frame.len > 0) {
+		flush_frame(screen);
+	}
+}
+
+// Gives the bottom row back and leaves the cursor where the scrolling text ends
+void pin_stop(struct pinned_screen* screen, const char* prefix) {
+	pin_render(screen, prefix);
+	take_pending(screen, true);
+	if (screen->mid_line) {
+		buffer_append_str(&screen->frame, "\n");
+	}
+
+	char reset[64];
+	snprintf(reset, sizeof(reset), "\x1B" "7\x1B[%d;1H\x1B[2K\x1B[r\x1B" "8", screen->rows);
+	buffer_append_str(&screen->frame, reset);
+	flush_frame(screen);
+
+	free(screen->pending.data);
+	free(screen->frame.data);
+}
+
+// Early errors (--errors, --fail-fast)
+//
+// The lines matching the error pattern are shown above the teased line as soon as
+// they are written, with the ERROR_CONTEXT_LINES lines before them, instead of
+// waiting for the command to exit. With --fail-fast, the command is stopped after
+// a number of errors: it is started in its own process group, and the whole group
+// gets a SIGTERM, then a SIGKILL if it is still around after FAIL_FAST_GRACE_SECS.
+
+struct error_watch {
+	regex_t pattern;
+	// Stop the command after this many errors, 0 for never
+	int limit;
+	int count;
+	bool terminated;
+	bool killed;
+	struct timespec terminated_at;
+	// The last lines that haven't been shown, in a ring
+	char context[ERROR_CONTEXT_LINES][MAX_LINE_BYTES + 1];
+	int context_start;
+	int context_len;
+	// To be shown above the teased line
+	struct buffer shown;
+};
+
+void error_watch_reset(struct error_watch* watch) {
+	watch->count = 0;
+	watch->terminated = false;
+	watch->killed = false;
+	watch->context_start = 0;
+	watch->context_len = 0;
+	watch->shown.len = 0;
+}
+
+void watch_line(struct error_watch* watch, const char* line) {
+	if (regexec(&watch->pattern, line, 0, NULL, 0) != 0) {
+		// Keep it in case an error follows, the oldest one goes if the ring is full
+		int slot = (watch->context_start + watch->context_len) % ERROR_CONTEXT_LINES;
+		if (watch->context_len == ERROR_CONTEXT_LINES) {
+			watch->context_start = (watch->context_start + 1) % ERROR_CONTEXT_LINES;
+		} else {
+			watch->context_len++;
+		}
+		strcpy(watch->context[slot], line);
+		return;
+	}
+
+	for (int i = 0; i < watch->context_len; i++) {
+		buffer_append_str(&watch->shown, watch->context[(watch->context_start + i) % ERROR_CONTEXT_LINES]);
+		buffer_append_str(&watch->shown, "\n");
+	}
+	watch->context_len = 0;
+	buffer_append_str(&watch->shown, line);
+	buffer_append_str(&watch->shown, "\n");
+	watch->count++;
+}
+
+// Stops the command if it has printed enough errors
+void fail_fast(struct error_watch* watch, pid_t child_pid) {
+	if (watch->limit == 0 || watch->count < watch->limit || watch->killed) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!watch->terminated) {
+		char* message = format_string("Stopping the command after %d error%s\n",
+			watch->count, watch->count == 1 ? "" : "s");
+		buffer_append_str(&watch->shown, message);
+		free(message);
+
+		kill(-child_pid, SIGTERM);
+		watch->terminated = true;
+		watch->terminated_at = now;
+	} else if (timespec_diff_secs(&watch->terminated_at, &now) >= FAIL_FAST_GRACE_SECS) {
+		kill(-child_pid, SIGKILL);
+		watch->killed = true;
+	}
+}
+
+// With fail fast, the command is in its own process group. If tease has the
+// terminal, it is handed to that group for the run, so that the command can
+// still read from it and Ctrl-C/Ctrl-Z reach it, as if the shell had started it.
+// SIGTTOU is ignored meanwhile, so that tease can still write to the terminal,
+// and take it back, from the background.
+
+static struct sigaction ttou_action;
+
+bool give_terminal(pid_t child_pid) {
+	if (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+		return false;
+	}
+
+	struct sigaction ignore;
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGTTOU, &ignore, &ttou_action);
+
+	// posix_spawn has done it already, unless it has raced with us
+	setpgid(child_pid, child_pid);
+	if (tcsetpgrp(STDIN_FILENO, child_pid) < 0) {
+		sigaction(SIGTTOU, &ttou_action, NULL);
+		return false;
+	}
+	return true;
+}
+
+void take_terminal(void) {
+	if (tcsetpgrp(STDIN_FILENO, getpgrp()) < 0) {
+		perror("Couldn't take the terminal back");
+	}
+	sigaction(SIGTTOU, &ttou_action, NULL);
+}
+
+// Deals with the command stopping, which the shell can't do since it is in
+// another process group. On Ctrl-Z, tease stops along with it and continues it
+// on fg. If it has stopped on the terminal, which it doesn't have, it would wait
+// forever, so it is killed. Otherwise, e.g. kill -STOP, it is waited for until
+// it is continued, as with any stopped job.
+void child_stopped(pid_t child_pid, int sig, bool* handed_off) {
+	if (sig == SIGTTIN || sig == SIGTTOU) {
+		error("The command has stopped (%s), killing it\n", strsignal(sig));
+		kill(-child_pid, SIGKILL);
+		kill(-child_pid, SIGCONT);
+		return;
+	}
+
+	if (*handed_off && (sig == SIGTSTP || sig == SIGSTOP)) {
+		take_terminal();
+		*handed_off = false;
+		raise(SIGSTOP);
+
+		// Only take the terminal again if we were continued in the foreground
+		*handed_off = give_terminal(child_pid);
+		kill(-child_pid, SIGCONT);
+	}
+}
+
+// Prints the errors found so far above the teased line.
+// Returns true if there was anything to print.
+bool print_errors(struct error_watch* watch) {
+	if (watch->shown.len == 0) {
+		return false;
+	}
+	printf("\x1B[2K\r");
+	fwrite(watch->shown.data, 1, watch->shown.len, stdout);
+	fflush(stdout);
+	watch->shown.len = 0;
+	return true;
+}
+
+void handle_line(const char* line, void* ctx) {
+	const struct run_options* options = ctx;
+	if (options->warnings != NULL && regexec(&options->warnings->pattern, line, 0, NULL, 0) == 0) {
+		warning_set_add(options->warnings, line);
+	}
+	if (options->errors != NULL) {
+		watch_line(options->errors, line);
+	}
+}
+
+// Runs the command with its output going to the temp file, and prints the whole
+// output if it fails. Unless it is quiet, the last line is teased while the
+// command is running; otherwise tease blocks on the child, so the timings in
+// result are not skewed by the polling interval.
+//
+// Returns -1 if the command couldn't be run at all, 0 otherwise.
+int run_command(char* argv[], char* envp[], int tmpfd, const struct run_options* options, struct run_result* result) {
+	int ret = -1;
+
+	// Start from an empty file, see the temp file notes at the top
+	off_t last_size = 0;
+	struct line_scanner scanner = { .scanned = 0, .len = 0 };
+	if (options->warnings != NULL) {
+		warning_set_clear(options->warnings);
+	}
+	if (options->errors != NULL) {
+		error_watch_reset(options->errors);
+	}
+	if (ftruncate(tmpfd, 0) < 0 || lseek(tmpfd, 0, SEEK_SET) < 0) {
+		perror("Couldn't truncate the temp file");
+		return -1;
+	}
+
+	/*
+		How to read child's output and send to a file:
+			- Create a pipe
+			- Tie the pipe's input to the stdout of the child
+			- And read from the pie's output from the parent
+			- Then, we can grab the last line for print
+			- While writing the whole thing to the tempfile we created above.
+
+		Alternatively,
+			- Tie the pipe's output to the file directly
+			- Watch the file via inotify (or poll/read every 200ms).
+			- And read the changes
+
+		Decided to go with the alternative path and polling (inotify etc are platform
+		specific). And, I think piping from the child straight to the temp file would be
+		faster, though I didn't measure. Just assuming that in the first option, tease
+		process might become a bottleneck. With the approach I chose, we are not in between
+		that process, we just read from the output file at certain intervals.
+	*/
+
+	// With --errors, the error lines go above the pinned line instead of stderr
+	struct pinned_screen screen;
+	bool pinned = options->pin && !options->quiet && pin_start(&screen);
+	bool relaying = pinned && options->errors == NULL;
+	int stdout_pipe[2] = { -1, -1 };
+	int stderr_pipe[2] = { -1, -1 };
+	if (relaying) {
+		if (pipe(stdout_pipe) < 0 || pipe(stderr_pipe) < 0) {
+			perror("Couldn't create the pipes for the output");
+			goto cleanup_pin;
+		}
+		// The child only gets the write ends, as its stdout and stderr
+		int* pipes[] = { stdout_pipe, stderr_pipe };
+		for (int i = 0; i < 2; i++) {
+			fcntl(pipes[i][0], F_SETFD, FD_CLOEXEC);
+			fcntl(pipes[i][1], F_SETFD, FD_CLOEXEC);
+			fcntl(pipes[i][0], F_SETFL, fcntl(pipes[i][0], F_GETFL) | O_NONBLOCK);
+		}
+	}
+
+	posix_spawn_file_actions_t file_actions;
+	if (posix_spawn_file_actions_init(&file_actions) < 0) {
+		perror("Couldn't init file actions");
+		goto cleanup_pin;
+	}
+
+	// Its own process group, so that fail fast can stop everything it has started
+	posix_spawnattr_t attr;
+	bool own_group = options->errors != NULL && options->errors->limit > 0;
+	bool handed_off = false;
+	if (own_group) {
+		if (posix_spawnattr_init(&attr) != 0) {
+			perror("Couldn't init spawn attributes");
+			own_group = false;
+			goto cleanup;
+		}
+		if (posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP) != 0 ||
+		    posix_spawnattr_setpgroup(&attr, 0) != 0) {
+			perror("Couldn't set the process group");
+			goto cleanup;
+		}
+	}
+
+	// addup2 closes the dest file descr (stdout) if it is open before duplication
+	if (posix_spawn_file_actions_adddup2(&file_actions, relaying ? stdout_pipe[1] : tmpfd, STDOUT_FILENO) < 0) {
+	  perror("Couldn't connect stdout to the temp file"); goto cleanup;
+	}
+
+  // What to do with the stderr
+  //
+  //   - Option 1: connect to the same output as stdout (will lose what is
+  //   stdout and what is stderr)
+  //   - Option 2: connect to another file (will lose the order)
+  //   - Option 3: don't touch it, let it go to the terminal (it will be
+  //   printed before stdout if the process exit with non-zero, but better
+  //   to let the user know about the errors and shell redirections would
+  //   work).
+  //	 - Option 4: connect to the same file as stdout, but with a
+  //   different color (not sure if possible)
+  //
+  // Let's go with the option 1. Not much code, and can be converted to 4.
+  // In the future, I might change this into Option 3 since the error messages
+  // are important. For programs that spams stderr, there can be an option
+  // or use shell redirection feature like &2>1.
+  //
+  // --pin is the Option 3, but through a pipe, and stdout through another one
+  // so that tease can keep them in order in the temp file, see pin_start.
+  //
+  if (relaying) {
+    if (posix_spawn_file_actions_adddup2(&file_actions, stderr_pipe[1], STDERR_FILENO) < 0) {
+      perror("Couldn't connect stderr to the pipe"); goto cleanup;
+    }
+  } else if (posix_spawn_file_actions_adddup2(&file_actions, tmpfd, STDERR_FILENO) < 0) {
+	  perror("Couldn't connect stderr to the temp file"); goto cleanup;
+	}
+
+	struct timespec started_at, finished_at;
+	clock_gettime(CLOCK_MONOTONIC, &started_at);
+
+	pid_t child_pid;
+	int spawn_res = posix_spawnp(
+		/* pid */ &child_pid,
+		/* file */ argv[0],
+		/* file actions */ &file_actions,
+		/* attrp */ own_group ? &attr : NULL,
+		/* argv */ argv,
+		envp
+	);
+
+	if (spawn_res == ENOENT) {
+		error("Unknown command: %s\n", argv[0]);
+		goto cleanup;
+	}
+
+	if (spawn_res != 0) {
+		errno = spawn_res;
+		perror("Couldn't start the process");
+		goto cleanup;
+	}
+
+	running_in_group = own_group;
+	running_child = child_pid;
+	if (own_group) {
+		handed_off = give_terminal(child_pid);
+	}
+	if (relaying) {
+		close(stdout_pipe[1]);
+		close(stderr_pipe[1]);
+		stdout_pipe[1] = stderr_pipe[1] = -1;
+	}
+
+	// start polling the file
+	struct timespec time_spec;
+	time_spec.tv_nsec = POLL_TIME_IN_MS * 1000 * 1000;
+	time_spec.tv_sec = 0;
+	struct rusage usage;
+	int stat_loc;
+
+	// This is going to be useful to print last new line at the end.
+	bool printed_something = false;
+	char last_line[HOW_MANY_BYTES_FROM_THE_END + 1];
+	const char* status = "";
+	// Skipped by poll unless relaying
+	struct pollfd relayed[2] = {
+		{ .fd = stdout_pipe[0], .events = POLLIN },
+		{ .fd = stderr_pipe[0], .events = POLLIN },
+	};
+	while (true) {
+		int wait_res;
+		if (options->quiet) {
+			wait_res = wait4(child_pid, &stat_loc, 0, &usage);
+		} else {
+			// Let's wait a bit before we do anything
+			if (pinned) {
+				pin_wait_frame(relayed, tmpfd, &screen);
+			} else {
+				nanosleep(&time_spec, NULL);
+			}
+
+			// When relaying, the status line comes from the stdout pipe instead
+			const char* line = relaying ? NULL : read_last_line(tmpfd, &last_size, last_line);
+			if (line != NULL) {
+				status = line;
+			}
+			if (options->warnings != NULL || options->errors != NULL) {
+				scan_lines(tmpfd, capture_end(tmpfd), &scanner, false, handle_line, (void*)options);
+			}
+			if (options->errors != NULL) {
+				fail_fast(options->errors, child_pid);
+			}
+			if (options->on_poll != NULL) {
+				options->on_poll(options->poll_ctx);
+			}
+
+			if (pinned) {
+				if (line != NULL) {
+					strcpy(screen.status, line);
+					screen.status_changed = true;
+				}
+				if (options->errors != NULL) {
+					buffer_append(&screen.pending, options->errors->shown.data, options->errors->shown.len);
+					options->errors->shown.len = 0;
+				}
+				pin_render(&screen, options->prefix);
+			} else {
+				bool printed_errors = options->errors != NULL && print_errors(options->errors);
+				if (line != NULL || printed_errors) {
+					printf("\x1B[2K\r%s%s", options->prefix, status);
+					fflush(stdout);
+					printed_something = true;
+				}
+			}
+
+			// wait_res will be greater than zero (equals to child_pid) if the child is exited
+			// Hence we can break the loop
+			wait_res = wait4(child_pid, &stat_loc, WNOHANG | (own_group ? WUNTRACED : 0), &usage);
+		}
+
+		if (wait_res < 0) {
+			running_child = 0;
+			perror("Failed to wait the child");
+			goto cleanup;
+		} else if (wait_res > 0 && WIFSTOPPED(stat_loc)) {
+			child_stopped(child_pid, WSTOPSIG(stat_loc), &handed_off);
+		} else if (wait_res > 0) {
+			break;
+		}
+	}
+
+	running_child = 0;
+	if (handed_off) {
+		take_terminal();
+		handed_off = false;
+		// The terminal's Ctrl-C went to the command only, tease is interrupted too
+		if (WIFSIGNALED(stat_loc) && (WTERMSIG(stat_loc) == SIGINT || WTERMSIG(stat_loc) == SIGQUIT)) {
+			interrupted = WTERMSIG(stat_loc);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finished_at);
+	if (relaying) {
+		// What is left in the pipes, a grandchild may still hold them open though
+		while (relay_ready(relayed, 0, tmpfd, &screen)) {
+		}
+	} else if (pinned) {
+		const char* line = read_last_line(tmpfd, &last_size, last_line);
+		if (line != NULL) {
+			strcpy(screen.status, line);
+		}
+	}
+	if (options->warnings != NULL || options->errors != NULL) {
+		scan_lines(tmpfd, capture_end(tmpfd), &scanner, true, handle_line, (void*)options);
+	}
+	if (pinned) {
+		if (options->errors != NULL) {
+			buffer_append(&screen.pending, options->errors->shown.data, options->errors->shown.len);
+			options->errors->shown.len = 0;
+		}
+		pin_stop(&screen, options->prefix);
+		pinned = false;
+
+		// Back to the usual teasing for the end of the run
+		if (screen.status[0] != 0) {
+			printf("%s%s", options->prefix, screen.status);
+			fflush(stdout);
+			printed_something = true;
+		}
+	}
+	result->wall_secs = timespec_diff_secs(&started_at, &finished_at);
+	result->cpu_secs = timeval_secs(&usage.ru_utime) + timeval_secs(&usage.ru_stime);
+#ifdef __APPLE__
+	result->max_rss_kb = usage.ru_maxrss / 1024.0; // bytes on macOS
+#else
+	result->max_rss_kb = usage.ru_maxrss;
+#endif
+
+	// Reflect the exit status of the child, the shell way for the signals
+	if (WIFEXITED(stat_loc)) {
+		result->exit_status = WEXITSTATUS(stat_loc);
+	} else {
+		result->exit_status = 128 + WTERMSIG(stat_loc);
+	}
+
+	if (result->exit_status == 0) {
+		// Write a newline at the end
+		if (printed_something) {
+			fputs(options->keep_last_line ? "\n" : "\x1B[2K\r", stdout);
+			fflush(stdout);
+		}
+		// Errors in the last bits of the output, no need on failure since all is printed
+		if (options->errors != NULL) {
+			print_errors(options->errors);
+		}
+	} else {
+		// Child failed, print the full content of the temp file
+		dump_output(tmpfd);
+	}
+	ret = 0;
+
+cleanup:
+	if (handed_off) {
+		take_terminal();
+	}
+	running_in_group = 0;
+	if (own_group && posix_spawnattr_destroy(&attr) != 0) {
+		perror("Couldn't destroy the spawn attributes");
+	}
+	if (posix_spawn_file_actions_destroy(&file_actions) < 0) {
+		perror("Couldn't destroy the file actions object");
+	}
+
+cleanup_pin:
+	if (pinned) {
+		pin_stop(&screen, options->prefix);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (stdout_pipe[i] >= 0) {
+			close(stdout_pipe[i]);
+		}
+		if (stderr_pipe[i] >= 0) {
+			close(stderr_pipe[i]);
+		}
+	}
+	return ret;
+}
+
+// Benchmark mode (--repeat)
+//
+// Runs the command(s) quietly for a number of times and reports statistics,
+// like hyperfine but with tease's manners: nothing is printed unless a run
+// fails. Failed runs are not included in the statistics.
+
+struct benchmark {
+	char** argv;
+	const char* name;
+	double* wall_secs;
+	double* cpu_secs;
+	double* max_rss_kb;
+	int measured;
+	int failed;
+	int last_exit_status;
+};
+
+struct summary {
+	double mean;
+	double median;
+	double stddev;
+	double min;
+	double max;
+	int outliers;
+};
+
+int compare_doubles(const void* a, const void* b) {
+	double d1 = *(const double*)a, d2 = *(const double*)b;
+	return (d1 > d2) - (d1 < d2);
+}
+
+// Linear interpolation between the closest ranks, samples must be sorted
+double quantile(const double* sorted, int n, double q) {
+	double pos = q * (n - 1);
+	int lower = (int)pos;
+	if (lower + 1 >= n) {
+		return sorted[n - 1];
+	}
+	return sorted[lower] + (pos - lower) * (sorted[lower + 1] - sorted[lower]);
+}
+
+// Sorts samples in place. Outliers are the ones outside of 1.5 IQR from the quartiles.
+void summarize(double* samples, int n, struct summary* s) {
+	qsort(samples, n, sizeof(double), compare_doubles);
+
+	double sum = 0;
+	for (int i = 0; i < n; i++) {
+		sum += samples[i];
+	}
+	s->mean = sum / n;
+
+	double squares = 0;
+	for (int i = 0; i < n; i++) {
+		squares += (samples[i] - s->mean) * (samples[i] - s->mean);
+	}
+	s->stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+
+	s->median = quantile(samples, n, 0.5);
+	s->min = samples[0];
+	s->max = samples[n - 1];
+
+	double q1 = quantile(samples, n, 0.25);
+	double q3 = quantile(samples, n, 0.75);
+	double iqr = q3 - q1;
+	s->outliers = 0;
+	for (int i = 0; i < n; i++) {
+		if (samples[i] < q1 - 1.5 * iqr || samples[i] > q3 + 1.5 * iqr) {
+			s->outliers++;
+		}
+	}
+}
+
+void print_summary(const char* what, const char* fmt, double* samples, int n, struct summary* s) {
+	summarize(samples, n, s);
+	printf("  %-8s", what);
+	printf(fmt, s->mean);
+	printf(" ± ");
+	printf(fmt, s->stddev);
+	printf("  (median ");
+	printf(fmt, s->median);
+	printf(", min ");
+	printf(fmt, s->min);
+	printf(", max ");
+	printf(fmt, s->max);
+	printf(", %d outlier%s)\n", s->outliers, s->outliers == 1 ? "" : "s");
+}
+
+// Joins the arguments with spaces, only used for display purposes
+char* join_args(char* argv[]) {
+	size_t len = 1;
+	for (int i = 0; argv[i] != NULL; i++) {
+		len += strlen(argv[i]) + 1;
+	}
+	char* joined = malloc(len);
+	if (joined == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	joined[0] = 0;
+	for (int i = 0; argv[i] != NULL; i++) {
+		if (i > 0) {
+			strcat(joined, " ");
+		}
+		strcat(joined, argv[i]);
+	}
+	return joined;
+}
+
+double* alloc_samples(int n) {
+	double* samples = calloc(n, sizeof(double));
+	if (samples == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	return samples;
+}
+
+// Returns -1 if the command couldn't be run at all, 0 otherwise.
+int run_benchmark(struct benchmark* bench, const char* label, char* envp[], int tmpfd, int warmup, int repeat) {
+	struct run_options options = { .quiet = true, .keep_last_line = false, .prefix = "", .warnings = NULL, .pin = false };
+	struct run_result result;
+	for (int i = 0; i < warmup + repeat; i++) {
+		bool warming_up = i < warmup;
+		if (warming_up) {
+			printf("\x1B[2K\r%s: warmup %d/%d", label, i + 1, warmup);
+		} else {
+			printf("\x1B[2K\r%s: run %d/%d", label, i - warmup + 1, repeat);
+		}
+		fflush(stdout);
+
+		if (run_command(bench->argv, envp, tmpfd, &options, &result) < 0) {
+			return -1;
+		}
+
+		if (result.exit_status != 0) {
+			error("%s: %s %d failed with exit status %d\n", label,
+				warming_up ? "warmup" : "run", warming_up ? i + 1 : i - warmup + 1,
+				result.exit_status);
+			bench->failed++;
+			bench->last_exit_status = result.exit_status;
+		} else if (!warming_up) {
+			bench->wall_secs[bench->measured] = result.wall_secs;
+			bench->cpu_secs[bench->measured] = result.cpu_secs;
+			bench->max_rss_kb[bench->measured] = result.max_rss_kb;
+			bench->measured++;
+		}
+	}
+	printf("\x1B[2K\r");
+	fflush(stdout);
+	return 0;
+}
+
+// Returns the mean wall time in seconds, or zero if none of the runs succeeded
+double report_benchmark(struct benchmark* bench, const char* label, double* wall_stddev) {
+	printf("%s: %s\n", label, bench->name);
+	if (bench->failed > 0) {
+		printf("  %d run%s failed\n", bench->failed, bench->failed == 1 ? "" : "s");
+	}
+	if (bench->measured == 0) {
+		printf("  no successful runs to measure\n");
+		return 0;
+	}
+
+	struct summary wall, cpu, rss;
+	print_summary("wall", "%.3f s", bench->wall_secs, bench->measured, &wall);
+	print_summary("cpu", "%.3f s", bench->cpu_secs, bench->measured, &cpu);
+	print_summary("max rss", "%.0f KiB", bench->max_rss_kb, bench->measured, &rss);
+
+	*wall_stddev = wall.stddev;
+	return wall.mean;
+}
+
+int benchmark_main(char* argv_a[], char* argv_b[], char* envp[], int warmup, int repeat) {
+	struct benchmark benchmarks[2];
+	const char* labels[2] = {"A", "B"};
+	int count = argv_b != NULL ? 2 : 1;
+	benchmarks[0].argv = argv_a;
+	benchmarks[1].argv = argv_b;
+
+	for (int i = 0; i < count; i++) {
+		benchmarks[i].name = join_args(benchmarks[i].argv);
+		benchmarks[i].wall_secs = alloc_samples(repeat);
+		benchmarks[i].cpu_secs = alloc_samples(repeat);
+		benchmarks[i].max_rss_kb = alloc_samples(repeat);
+		benchmarks[i].measured = 0;
+		benchmarks[i].failed = 0;
+		benchmarks[i].last_exit_status = 0;
+	}
+
+	int exit_status = EXIT_SUCCESS;
+	int tmpfd = create_temp_file();
+
+	for (int i = 0; i < count; i++) {
+		if (run_benchmark(&benchmarks[i], labels[i], envp, tmpfd, warmup, repeat) < 0) {
+			exit_status = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	double means[2], stddevs[2];
+	for (int i = 0; i < count; i++) {
+		means[i] = report_benchmark(&benchmarks[i], labels[i], &stddevs[i]);
+		if (benchmarks[i].failed > 0) {
+			exit_status = benchmarks[i].last_exit_status;
+		}
+	}
+
+	if (count == 2 && means[0] > 0 && means[1] > 0) {
+		// Propagate the relative errors of both means into the ratio
+		bool a_is_faster = means[0] <= means[1];
+		double ratio = a_is_faster ? means[1] / means[0] : means[0] / means[1];
+		double ratio_stddev = ratio * sqrt(
+			(stddevs[0] / means[0]) * (stddevs[0] / means[0]) +
+			(stddevs[1] / means[1]) * (stddevs[1] / means[1]));
+		printf("%s is %.2f ± %.2f times faster than %s\n",
+			a_is_faster ? "A" : "B", ratio, ratio_stddev, a_is_faster ? "B" : "A");
+	}
+
+cleanup:
+	remove_temp_file(tmpfd);
+	for (int i = 0; i < count; i++) {
+		free((char*)benchmarks[i].name);
+		free(benchmarks[i].wall_secs);
+		free(benchmarks[i].cpu_secs);
+		free(benchmarks[i].max_rss_kb);
+	}
+	return exit_status;
+}
+
+// Job list mode (--jobs)
+//
+// Runs each line of a file as a shell command, one after another. Every finished
+// job is appended to a journal, so that an interrupted run can be picked up with
+// --resume: jobs that succeeded are skipped, failed and pending ones are run again.
+//
+// The journal is a text file with one record per finished job:
+//
+//   <exit status>\t<command>\n
+//
+// The last record of a command wins. A record without the trailing new line is a
+// torn write, and ignored. The journal is fsync'ed every JOURNAL_SYNC_EVERY
+// records or JOURNAL_SYNC_SECS seconds, whichever comes first, and before exiting;
+// the time is checked while a job runs too, so a long job doesn't hold back the
+// records of the quick ones before it. On --resume, a torn record is ended with a
+// new line first, so that the next one isn't glued to it;
+// a host crash loses at most that many records, which only means running those
+// jobs again.
+
+struct journal {
+	int fd;
+	int pending;
+	struct timespec last_sync;
+};
+
+struct journal_record {
+	char* command;
+	int exit_status;
+	int seq;
+};
+
+int compare_records(const void* a, const void* b) {
+	const struct journal_record* r1 = a;
+	const struct journal_record* r2 = b;
+	int cmp = strcmp(r1->command, r2->command);
+	return cmp != 0 ? cmp : r1->seq - r2->seq;
+}
+
+int compare_strings(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Returns the sorted commands whose last record in the journal is a success
+int load_finished_jobs(const char* path, char*** finished) {
+	char** lines;
+	int count = read_lines(path, true, &lines);
+	*finished = NULL;
+	if (count < 0) {
+		if (errno != ENOENT) {
+			perror("Couldn't read the journal");
+			exit(EXIT_FAILURE);
+		}
+		return 0; // Nothing to resume
+	}
+
+	struct journal_record* records = calloc(count + 1, sizeof(struct journal_record));
+	*finished = calloc(count + 1, sizeof(char*));
+	if (records == NULL || *finished == NULL) {
+		perror("Couldn't allocate memory");
+		exit(EXIT_FAILURE);
+	}
+
+	int nrecords = 0;
+	for (int i = 0; i < count; i++) {
+		char* tab = strchr(lines[i], '\t');
+		if (tab == NULL) {
+			continue;
+		}
+		*tab = 0;
+		records[nrecords].exit_status = atoi(lines[i]);
+		records[nrecords].command = tab + 1;
+		records[nrecords].seq = i;
+		nrecords++;
+	}
+
+	qsort(records, nrecords, sizeof(struct journal_record), compare_records);
+
+	int nfinished = 0;
+	for (int i = 0; i < nrecords; i++) {
+		bool last_of_command = i + 1 == nrecords || strcmp(records[i].command, records[i + 1].command) != 0;
+		if (last_of_command && records[i].exit_status == 0) {
+			(*finished)[nfinished++] = strdup(records[i].command);
+		}
+	}
+
+	free(records);
+	free_lines(lines, count);
+	return nfinished;
+}
+
+int journal_sync(struct journal* journal) {
+	clock_gettime(CLOCK_MONOTONIC, &journal->last_sync);
+	if (journal->pending == 0) {
+		return 0;
+	}
+	journal->pending = 0;
+	if (fsync(journal->fd) < 0) {
+		perror("Couldn't sync the journal");
+		return -1;
+	}
+	return 0;
+}
+
+// Syncs the pending records if the last sync was JOURNAL_SYNC_SECS ago
+int journal_sync_if_due(struct journal* journal) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (journal->pending > 0 && now.tv_sec - journal->last_sync.tv_sec >= JOURNAL_SYNC_SECS) {
+		return journal_sync(journal);
+	}
+	return 0;
+}
+
+int journal_append(struct journal* journal, const char* command, int exit_status) {
+	// A single write per record, so that a crash tears at most the last one
+	char* record = format_string("%d\t%s\n", exit_status, command);
+	ssize_t len = strlen(record);
+	ssize_t written = write(journal->fd, record, len);
+	free(record);
+	if (written != len) {
+		perror("Couldn't write to the journal");
+		return -1;
+	}
+
+	journal->pending++;
+	if (journal->pending >= JOURNAL_SYNC_EVERY) {
+		return journal_sync(journal);
+	}
+	return journal_sync_if_due(journal);
+}
+
+// Called while a job runs
+void journal_tick(void* journal) {
+	journal_sync_if_due(journal);
+}
+
+// Ends a torn last record with a new line
+int journal_mend(struct journal* journal) {
+	off_t size = lseek(journal->fd, 0, SEEK_END);
+	char last = '\n';
+	if (size > 0 && pread(journal->fd, &last, 1, size - 1) != 1) {
+		perror("Couldn't read the journal");
+		return -1;
+	}
+	if (last != '\n' && write(journal->fd, "\n", 1) != 1) {
+		perror("Couldn't write to the journal");
+		return -1;
+	}
+	return 0;
+}
+
+// options is what to do on every job, the prefix is set here
+int jobs_main(const char* jobs_path, const char* journal_path, bool resume, struct ratchet* ratchet, struct run_options options, char* envp[]) {
+	char** jobs;
+	int njobs = read_lines(jobs_path, false, &jobs);
+	if (njobs < 0) {
+		perror("Couldn't read the job list");
+		return EXIT_FAILURE;
+	}
+
+	char* default_journal_path = NULL;
+	if (journal_path == NULL) {
+		default_journal_path = format_string("%s%s", jobs_path, JOURNAL_SUFFIX);
+		journal_path = default_journal_path;
+	}
+
+	char** finished = NULL;
+	int nfinished = resume ? load_finished_jobs(journal_path, &finished) : 0;
+
+	struct journal journal = { .pending = 0 };
+	clock_gettime(CLOCK_MONOTONIC, &journal.last_sync);
+	int flags = O_RDWR | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC);
+	if ((journal.fd = open(journal_path, flags, 0644)) < 0 || (resume && journal_mend(&journal) < 0)) {
+		if (journal.fd < 0) {
+			perror("Couldn't open the journal");
+		} else {
+			close(journal.fd);
+		}
+		free_lines(jobs, njobs);
+		return EXIT_FAILURE;
+	}
+
+	// So that the journal gets synced
+	catch_interrupts();
+
+	int tmpfd = create_temp_file();
+	char* shell_argv[] = { "/bin/sh", "-c", NULL, NULL };
+	char prefix[32];
+	options.keep_last_line = false;
+	options.prefix = prefix;
+	options.on_poll = journal_tick;
+	options.poll_ctx = &journal;
+	struct run_result result;
+	int succeeded = 0, failed = 0, skipped = 0;
+	int exit_status = EXIT_SUCCESS;
+
+	for (int i = 0; i < njobs && !interrupted; i++) {
+		if (nfinished > 0 && bsearch(&jobs[i], finished, nfinished, sizeof(char*), compare_strings) != NULL) {
+			skipped++;
+			continue;
+		}
+
+		// Don't let the records of the previous jobs wait for this one
+		journal_sync_if_due(&journal);
+
+		snprintf(prefix, sizeof(prefix), "[%d/%d] ", i + 1, njobs);
+		printf("\x1B[2K\r%s", prefix);
+		fflush(stdout);
+
+		shell_argv[2] = jobs[i];
+		if (run_command(shell_argv, envp, tmpfd, &options, &result) < 0) {
+			exit_status = EXIT_FAILURE;
+			break;
+		}
+
+		if (interrupted) {
+			break; // Killed along with us, it is still pending
+		}
+
+		if (result.exit_status == 0 && ratchet != NULL && ratchet_check(ratchet, jobs[i])) {
+			result.exit_status = EXIT_FAILURE;
+		}
+
+		if (result.exit_status == 0) {
+			succeeded++;
+		} else {
+			error("%sfailed with exit status %d: %s\n", prefix, result.exit_status, jobs[i]);
+			failed++;
+		}
+
+		if (journal_append(&journal, jobs[i], result.exit_status) < 0) {
+			exit_status = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	journal_sync(&journal);
+	if (close(journal.fd) < 0) {
+		perror("Couldn't close the journal");
+	}
+	remove_temp_file(tmpfd);
+
+	printf("\x1B[2K\r%d succeeded, %d failed, %d skipped, %d pending\n",
+		succeeded, failed, skipped, njobs - succeeded - failed - skipped);
+	fflush(stdout);
+	if (interrupted) {
+		if (default_journal_path == NULL) {
+			error("Interrupted, continue with: tease --jobs=%s --journal=%s --resume\n", jobs_path, journal_path);
+		} else {
+			error("Interrupted, continue with: tease --jobs=%s --resume\n", jobs_path);
+		}
+		exit_status = 128 + interrupted;
+	} else if (failed > 0 && exit_status == EXIT_SUCCESS) {
+		exit_status = EXIT_FAILURE;
+	}
+
+	if (finished != NULL) {
+		free_lines(finished, nfinished);
+	}
+	free(default_journal_path);
+	free_lines(jobs, njobs);
+	return exit_status;
+}
+
+// Exits if the pattern is not a valid POSIX extended regular expression
+void compile_pattern(regex_t* regex, const char* pattern, const char* what) {
+	int regcomp_res = regcomp(regex, pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	if (regcomp_res != 0) {
+		char message[256];
+		regerror(regcomp_res, regex, message, sizeof(message));
+		error("Invalid %s pattern: %s\n", what, message);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Parses the value of --option=N, exits if it is not a positive number (or
+// zero, when allowed).
+int parse_count(const char* arg, const char* value, bool allow_zero) {
+	char* end;
+	errno = 0;
+	long n = strtol(value, &end, 10);
+	if (errno != 0 || *value == 0 || *end != 0 || n < 0 || n > 1000000 || (n == 0 && !allow_zero)) {
+		error("Invalid value for %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return (int)n;
+}
+
+void usage(void) {
+	error("usage: tease COMMAND...\n"
+	      "       tease --repeat=N [--warmup=N] COMMAND... [" VERSUS_SEPARATOR " COMMAND...]\n"
+	      "       tease --jobs=FILE [--journal=FILE] [--resume]\n"
+	      "options: --ratchet[=FILE] --ratchet-fail --warning-pattern=REGEX\n"
+	      "         --pin --errors --error-pattern=REGEX --fail-fast[=N]\n");
+}
+
+int main(int argc, char* argv[], char* envp[]) {
+	// Create a temp file
+	// Capture the output
+	// Write the content to the temp file
+	// Also, grab the last line
+	// Print it
+
+	// Check inputs
+	int repeat = 0;
+	int warmup = 0;
+	const char* jobs_path = NULL;
+	const char* journal_path = NULL;
+	bool resume = false;
+	const char* ratchet_path = NULL;
+	const char* warning_pattern = DEFAULT_WARNING_PATTERN;
+	struct ratchet ratchet = { .fail_on_new = false };
+	bool pin = false;
+	bool show_errors = false;
+	const char* error_pattern = DEFAULT_ERROR_PATTERN;
+	struct error_watch errors = { .limit = 0 };
+	int argi = 1;
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+		char* arg = argv[argi];
+		if (strcmp(arg, "--") == 0) {
+			argi++;
+			break;
+		} else if (strncmp(arg, "--repeat=", 9) == 0) {
+			repeat = parse_count("--repeat", arg + 9, false);
+		} else if (strncmp(arg, "--warmup=", 9) == 0) {
+			warmup = parse_count("--warmup", arg + 9, true);
+		} else if (strncmp(arg, "--jobs=", 7) == 0) {
+			jobs_path = arg + 7;
+		} else if (strncmp(arg, "--journal=", 10) == 0) {
+			journal_path = arg + 10;
+		} else if (strcmp(arg, "--resume") == 0) {
+			resume = true;
+		} else if (strcmp(arg, "--ratchet") == 0) {
+			ratchet_path = DEFAULT_BASELINE_FILE;
+		} else if (strncmp(arg, "--ratchet=", 10) == 0) {
+			ratchet_path = arg + 10;
+		} else if (strcmp(arg, "--ratchet-fail") == 0) {
+			ratchet.fail_on_new = true;
+		} else if (strncmp(arg, "--warning-pattern=", 18) == 0) {
+			warning_pattern = arg + 18;
+		} else if (strcmp(arg, "--pin") == 0) {
+			pin = true;
+		} else if (strcmp(arg, "--errors") == 0) {
+			show_errors = true;
+		} else if (strncmp(arg, "--error-pattern=", 16) == 0) {
+			error_pattern = arg + 16;
+		} else if (strcmp(arg, "--fail-fast") == 0) {
+			errors.limit = 1;
+		} else if (strncmp(arg, "--fail-fast=", 12) == 0) {
+			errors.limit = parse_count("--fail-fast", arg + 12, false);
+		} else {
+			error("Unknown option: %s\n", arg);
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (ratchet.fail_on_new && ratchet_path == NULL) {
+		ratchet_path = DEFAULT_BASELINE_FILE;
+	}
+	if (ratchet_path != NULL) {
+		if (repeat > 0) {
+			error("--ratchet doesn't work with --repeat\n");
+			exit(EXIT_FAILURE);
+		}
+		ratchet.path = ratchet_path;
+		compile_pattern(&ratchet.warnings.pattern, warning_pattern, "warning");
+	}
+
+	if (errors.limit > 0) {
+		show_errors = true;
+	}
+	if (show_errors) {
+		if (repeat > 0) {
+			error("--errors doesn't work with --repeat\n");
+			exit(EXIT_FAILURE);
+		}
+		compile_pattern(&errors.pattern, error_pattern, "error");
+	}
+
+	struct run_options options = {
+		.quiet = false, .keep_last_line = true, .prefix = "",
+		.warnings = ratchet_path != NULL ? &ratchet.warnings : NULL, .pin = pin,
+		.errors = show_errors ? &errors : NULL
+	};
+
+	if (jobs_path != NULL) {
+		if (argi < argc || repeat > 0 || warmup > 0) {
+			error("--jobs doesn't take a command, or --repeat\n");
+			exit(EXIT_FAILURE);
+		}
+		return jobs_main(jobs_path, journal_path, resume, ratchet_path != NULL ? &ratchet : NULL, options, envp);
+	}
+
+	if (journal_path != NULL || resume) {
+		error("--journal and --resume only make sense with --jobs\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (argi >= argc) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	char** command = argv + argi;
+
+	if (repeat > 0) {
+		char** versus = NULL;
+		for (int i = 0; command[i] != NULL; i++) {
+			if (strcmp(command[i], VERSUS_SEPARATOR) == 0) {
+				command[i] = NULL;
+				versus = command + i + 1;
+				break;
+			}
+		}
+		if (command[0] == NULL || (versus != NULL && versus[0] == NULL)) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		return benchmark_main(command, versus, envp, warmup, repeat);
+	}
+
+	if (warmup > 0) {
+		error("--warmup only makes sense with --repeat\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pin || errors.limit > 0) {
+		// So that the terminal gets its bottom row back, or to pass Ctrl-C on to the
+		// command's process group
+		catch_interrupts();
+	}
+
+	int tmpfd = create_temp_file();
+	struct run_result result;
+	int exit_status = EXIT_FAILURE;
+	if (run_command(command, envp, tmpfd, &options, &result) == 0) {
+		exit_status = result.exit_status;
+	}
+	if (exit_status == 0 && ratchet_path != NULL) {
+		char* name = join_args(command);
+		if (ratchet_check(&ratchet, name)) {
+			exit_status = EXIT_FAILURE;
+		}
+		free(name);
+	}
+	remove_temp_file(tmpfd);
+
+	if (interrupted) {
+		exit_status = 128 + interrupted;
 	}
 
 	return exit_status;